@@ -22,8 +22,12 @@ along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
 #include <cstdlib>
 
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/file.h>
 
 #include <fuse.h>
 
@@ -33,82 +37,910 @@ along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
 #include <libtorrent/peer_request.hpp>
 #include <libtorrent/alert_types.hpp>
 #include <libtorrent/magnet_uri.hpp>
+#include <libtorrent/bencode.hpp>
 
 #include <curl/curl.h>
 
 #include "btfs.h"
+#include "sha1.h"
 
 #define RETV(s, v) { s; return v; };
 
+// Seconds of data to keep ahead of each stream
+#define READAHEAD_SECONDS 5
+
+// Bounds of each stream's read-ahead window, in bytes
+#define MIN_WINDOW (1 << 20)
+#define MAX_WINDOW (64 << 20)
+
+// Highest believable media bitrate, in bytes per second. Anything above
+// comes from a broken duration.
+#define MAX_BITRATE (64 << 20)
+
+// Largest gap between reads, in bytes, that still counts as sequential
+#define SEQUENTIAL_SLACK (512 << 10)
+
+// Number of reads to prefetch ahead of a strided stream
+#define STRIDE_AHEAD 4
+
+// Number of evenly spread seek points to prefetch in media files
+#define SEEK_POINTS 10
+
+// Seconds to wait before parsing an index again that got nowhere
+#define REPROBE_SECONDS 10
+
+// Failed reads of a piece before giving up with EIO
+#define MAX_RETRIES 2
+
+// Read-only file descriptors to keep open, well below RLIMIT_NOFILE
+#define MAX_DESCRIPTORS 128
+
+// Bytes of consecutive pieces to read at once when checking cached data
+#define CHECK_CHUNK (8 << 20)
+
 using namespace btfs;
 
 libtorrent::session *session = NULL;
 
-libtorrent::torrent_handle handle;
+libtorrent::torrent_handle handle;
+
+pthread_t alert_thread;
+
+// Tells the alert thread to return, on unmount
+bool stopping = false;
+
+// Outstanding reads waiting for each piece, by piece index
+std::map<int,std::list<Read*> > pending;
+
+// Open file handles, each with its own sliding window
+std::list<Stream*> streams;
+
+// Container indexes of media files that have been opened, by file index
+std::map<int,Index> indexes;
+
+// Earliest time to parse an index again after a try that got nowhere
+std::map<int,double> reprobe;
+
+// Piece deadlines handed to libtorrent, as absolute times, by piece index
+std::map<int,double> deadlines;
+
+// Payload download rate of the torrent, in bytes per second
+int download_rate = 0;
+
+// Recently read pieces, to avoid asking libtorrent for the same piece over
+// and over when a piece is much larger than a FUSE read
+Cache cache;
+
+// Piece priorities last handed to libtorrent
+std::vector<int> priorities;
+
+// Piece priorities when no file is being read
+std::vector<int> baseline;
+
+// Directories whose files have had their first piece queued
+std::set<std::string> listed;
+
+// Compact copy of the file table, built once when metadata arrives
+Metadata metadata;
+
+// Downloaded pieces, kept here to not ask libtorrent all the time
+Bitfield pieces;
+
+// Pieces adopted from a cache dir on trust, to be hashed on first read
+Bitfield unverified;
+
+// Unverified pieces being hashed right now
+std::set<int> verifying;
+
+// Set while libtorrent rechecks everything after a bad adopted piece
+bool rechecking = false;
+
+// Pieces asked for with read_piece() whose alert hasn't arrived yet
+std::set<int> requested;
+
+// Read-only file descriptors of files under the save path
+Descriptors descriptors(MAX_DESCRIPTORS);
+
+std::map<std::string,int> files;
+std::map<std::string,std::set<std::string> > dirs;
+
+// Where fast-resume data is kept, with --cache-dir
+std::string resume_file;
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t resume_cond = PTHREAD_COND_INITIALIZER;
+
+// Number of save_resume_data() requests not answered yet
+int resume_pending = 0;
+
+static struct btfs_params params;
+
+static double
+now() {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static bool
+move_to_next_unfinished(int& piece) {
+	piece = pieces.next_unset(piece);
+
+	return piece < pieces.size();
+}
+
+static void
+prioritize(const std::vector<int>& wanted) {
+	if (wanted == priorities)
+		return;
+
+	// One message to libtorrent instead of one per piece
+	handle.prioritize_pieces(wanted);
+
+	priorities = wanted;
+}
+
+static void
+deadline(int piece, int ms) {
+	if (!params.deadlines || ms < 0 || pieces.get(piece))
+		return;
+
+	double t = now() + ms / 1000.0;
+
+	std::map<int,double>::iterator i = deadlines.find(piece);
+
+	// Already due at about the same time or earlier
+	if (i != deadlines.end() && i->second <= t + 0.1)
+		return;
+
+	handle.set_piece_deadline(piece, ms);
+
+	deadlines[piece] = t;
+}
+
+static void
+want(const Metadata::File& file, libtorrent::size_type from,
+		libtorrent::size_type to, int prio, int ms,
+		std::vector<int>& wanted) {
+	from = std::max(from, (libtorrent::size_type) 0);
+	to = std::min(to, file.size);
+
+	if (from >= to)
+		return;
+
+	int pl = metadata.piece_length;
+
+	int first = (file.offset + from) / pl;
+	int last = (file.offset + to - 1) / pl;
+
+	for (int p = first; p <= last; p++) {
+		if (pieces.get(p))
+			continue;
+
+		wanted[p] = std::max(wanted[p], prio);
+
+		deadline(p, ms);
+	}
+}
+
+static bool
+downloaded(const Metadata::File& file, range r) {
+	int pl = metadata.piece_length;
+
+	for (libtorrent::size_type o = r.first; o < r.second;
+			o = (o / pl + 1) * pl) {
+		if (!pieces.get((file.offset + o) / pl))
+			return false;
+	}
+
+	return true;
+}
+
+static void
+media(Stream *s, std::vector<int>& wanted) {
+	std::map<int,Index>::iterator i = indexes.find(s->file);
+
+	if (i == indexes.end())
+		return;
+
+	Index& index = i->second;
+
+	const Metadata::File& file = metadata.files[s->file];
+
+	// Once it has arrived, the alert thread parses it again
+	if (!index.complete && !downloaded(file, index.missing))
+		want(file, index.missing.first, index.missing.second, 7, 0,
+			wanted);
+
+	// The index itself, like a moov atom at the end of the file
+	for (size_t j = 0; j < index.ranges.size(); j++) {
+		want(file, index.ranges[j].first, index.ranges[j].second, 7, 0,
+			wanted);
+	}
+
+	if (index.seeks.empty())
+		return;
+
+	// Where seeks from the player's seek bar would land
+	for (int k = 1; k < SEEK_POINTS; k++) {
+		std::vector<libtorrent::size_type>::iterator j =
+			std::lower_bound(index.seeks.begin(), index.seeks.end(),
+				file.size * k / SEEK_POINTS);
+
+		if (j != index.seeks.end())
+			want(file, *j, *j + 1, 1, -1, wanted);
+	}
+}
+
+static void
+predict(Stream *s, std::vector<int>& wanted) {
+	const Metadata::File& file = metadata.files[s->file];
+
+	for (int k = 1; k <= STRIDE_AHEAD; k++) {
+		libtorrent::size_type o = s->offsets[0] + k * s->stride;
+
+		if (o < 0 || o >= file.size)
+			break;
+
+		// Due when the stream is expected to read it
+		want(file, o, o + s->lengths[0], 7 - k,
+			(int) (1000 * k * s->interval), wanted);
+	}
+}
+
+static void
+prefetch(Stream *s, std::vector<int>& wanted) {
+	const Metadata::File& file = metadata.files[s->file];
+
+	libtorrent::size_type n = (libtorrent::size_type) params.prefetch << 10;
+
+	// Header first, then trailer, as that's the order most readers of
+	// media and archives go for them
+	want(file, 0, n, 7, 0, wanted);
+	want(file, file.size - n, file.size, 7, 1000, wanted);
+}
+
+// Bytes per second of playback of a media stream, or 0 if unknown
+static double
+media_bitrate(Stream *s) {
+	std::map<int,Index>::iterator i = indexes.find(s->file);
+
+	if (i == indexes.end())
+		return 0;
+
+	double d = i->second.duration;
+
+	// Estimate from size and duration, if the container has a sane one
+	if (d >= 1 && metadata.files[s->file].size / d <= MAX_BITRATE)
+		return metadata.files[s->file].size / d;
+
+	// Otherwise, the player is probably reading at the bitrate
+	return s->rate;
+}
+
+static void
+window(Stream *s, std::vector<int>& wanted) {
+	if (s->pattern == Stream::RANDOM)
+		// No read-ahead, only the pieces that reads are blocked on
+		return;
+
+	if (s->pattern == Stream::STRIDED) {
+		// Only the pieces the next few reads are expected to touch
+		predict(s, wanted);
+		return;
+	}
+
+	const Metadata::File& file = metadata.files[s->file];
+
+	int pl = metadata.piece_length;
+
+	double bitrate = params.buffer_seconds > 0 ? media_bitrate(s) : 0;
+
+	libtorrent::size_type bytes;
+
+	if (bitrate > 0) {
+		// Enough for the configured seconds of playback, but no more
+		// than the whole file
+		bytes = std::max((libtorrent::size_type) std::min(bitrate *
+			params.buffer_seconds, (double) file.size),
+			(libtorrent::size_type) MIN_WINDOW);
+	} else {
+		// Read-ahead for a few seconds of what the stream consumes, or
+		// of its share of the download rate if that's higher
+		double rate = std::max(s->rate, (double) download_rate /
+			std::max((int) streams.size(), 1));
+
+		bytes = std::max(std::min(
+			(libtorrent::size_type) (rate * READAHEAD_SECONDS),
+			(libtorrent::size_type) MAX_WINDOW),
+			(libtorrent::size_type) MIN_WINDOW);
+	}
+
+	// Reads are nearing the end of the file. Get going on the start of
+	// the next one, as that's likely what's read next. This file may well
+	// be downloaded already.
+	if (s->next >= 0 && s->reads > 0 &&
+			file.size - (s->offsets[0] + s->lengths[0]) <= bytes)
+		want(metadata.files[s->next], 0, bytes, 4, -1, wanted);
+
+	int tail = s->cursor;
+
+	// Last piece with data of the file. It may be shared with the next
+	// file, but nothing after it is of any use to this stream.
+	int last = file.last;
+
+	if (!move_to_next_unfinished(tail) || tail > last)
+		return;
+
+	s->cursor = tail;
+
+	// At least the piece being read and the one after it
+	int n = std::max((int) ((bytes + pl - 1) / pl), 2);
+
+	// Rate the stream is expected to need the data at
+	double need = bitrate > 0 ? bitrate : s->rate > 0 ? s->rate :
+		(double) MIN_WINDOW / READAHEAD_SECONDS;
+
+	for (int k = 0; k < n && tail <= last; k++) {
+		// Taper off from 7 at the cursor to 1 at the end of the window
+		int prio = std::max(7 - k * 6 / n, 1);
+
+		wanted[tail] = std::max(wanted[tail], prio);
+
+		// Due when the stream is expected to get there
+		deadline(tail, (int) (1000.0 * k * pl / need));
+
+		tail++;
+	}
+}
+
+static void
+update() {
+	// Start from the baseline, so pieces that have left all windows drop
+	// back to what they had before any window
+	std::vector<int> wanted(baseline);
+
+	// Merge the windows of all streams that have been read from
+	for (streams_iter i = streams.begin(); i != streams.end(); ++i) {
+		prefetch(*i, wanted);
+
+		media(*i, wanted);
+
+		if ((*i)->cursor >= 0)
+			window(*i, wanted);
+	}
+
+	// Pieces that reads are blocked on
+	for (pending_iter i = pending.begin(); i != pending.end(); ++i) {
+		if (i->first < (int) wanted.size())
+			wanted[i->first] = 7;
+	}
+
+	// Deadlines of pieces nobody wants anymore
+	for (std::map<int,double>::iterator i = deadlines.begin();
+			i != deadlines.end();) {
+		if (wanted[i->first] > 0) {
+			++i;
+			continue;
+		}
+
+		handle.reset_piece_deadline(i->first);
+
+		deadlines.erase(i++);
+	}
+
+	prioritize(wanted);
+}
+
+static void
+jump(Stream *s, int piece, bool blocked) {
+	// Windows come out the same as last time, so spare the work. Unless
+	// a read has just started waiting for pieces.
+	if (!blocked && piece == s->jumped && s->pattern == s->jumped_pattern)
+		return;
+
+	s->jumped = piece;
+	s->jumped_pattern = s->pattern;
+
+	s->cursor = piece;
+
+	update();
+}
+
+void Stream::consumed(libtorrent::size_type offset, int size) {
+	double t = now();
+
+	if (last > 0)
+		interval = interval > 0 ? 0.7 * interval + 0.3 * (t - last) :
+			t - last;
+
+	last = t;
+
+	for (int i = HISTORY - 1; i > 0; i--) {
+		offsets[i] = offsets[i - 1];
+		lengths[i] = lengths[i - 1];
+	}
+
+	offsets[0] = offset;
+	lengths[0] = size;
+
+	reads = std::min(reads + 1, (int) HISTORY);
+
+	classify();
+
+	if (since <= 0)
+		since = t;
+
+	bytes += size;
+
+	// Sample over at least a second, as FUSE reads come in bursts
+	if (t - since < 1)
+		return;
+
+	double sample = bytes / (t - since);
+
+	rate = rate > 0 ? 0.7 * rate + 0.3 * sample : sample;
+
+	bytes = 0;
+	since = t;
+}
+
+void Stream::classify() {
+	int n = reads - 1, seq = 0;
+
+	for (int i = 0; i < n; i++) {
+		libtorrent::size_type gap = offsets[i] -
+			(offsets[i + 1] + lengths[i + 1]);
+
+		// Parallel kernel read-ahead may reorder reads a little
+		if (gap >= -SEQUENTIAL_SLACK && gap <= SEQUENTIAL_SLACK)
+			seq++;
+	}
+
+	if (n == 0 || seq * 2 > n) {
+		pattern = SEQUENTIAL;
+	} else if (n >= 2 && offsets[0] != offsets[1] &&
+			offsets[0] - offsets[1] == offsets[1] - offsets[2]) {
+		pattern = STRIDED;
+		stride = offsets[0] - offsets[1];
+	} else {
+		pattern = RANDOM;
+	}
+}
+
+int Bitfield::next_unset(int i) const {
+	if (i < 0)
+		i = 0;
+
+	for (int w = i / 64; w < (int) bits.size(); w++) {
+		unsigned long long x = ~bits[w];
+
+		// Ignore bits before i in the first word
+		if (w == i / 64)
+			x &= ~0ULL << (i % 64);
+
+		if (x)
+			return std::min(w * 64 + __builtin_ctzll(x), count);
+	}
+
+	return count;
+}
+
+static void
+release(std::vector<std::pair<int,libtorrent::file_slice> >& io) {
+	for (size_t i = 0; i < io.size(); ++i)
+		descriptors.put(io[i].second.file_index);
+
+	io.clear();
+}
+
+static bool
+available(int piece) {
+	return pieces.get(piece) && !unverified.get(piece);
+}
+
+static bool
+map_to_disk(libtorrent::peer_request& part,
+		std::vector<std::pair<int,libtorrent::file_slice> >& io) {
+	if (!available(part.piece))
+		return false;
+
+	std::vector<libtorrent::file_slice> slices = metadata.map_block(
+		part.piece, part.start, part.length);
+
+	std::vector<std::pair<int,libtorrent::file_slice> > mapped;
+
+	for (size_t i = 0; i < slices.size(); ++i) {
+		int fd = descriptors.get(slices[i].file_index);
+
+		if (fd < 0)
+			RETV(release(mapped), false);
+
+		mapped.push_back(std::make_pair(fd, slices[i]));
+	}
+
+	// Caller puts the descriptors back with release() when done
+	io.insert(io.end(), mapped.begin(), mapped.end());
+
+	return true;
+}
+
+static bool
+read_from_disk(std::vector<std::pair<int,libtorrent::file_slice> >& slices,
+		char *buf) {
+	for (size_t i = 0; i < slices.size(); ++i) {
+		int fd = slices[i].first;
+		libtorrent::file_slice& slice = slices[i].second;
+
+		for (libtorrent::size_type n = 0; n < slice.size;) {
+			ssize_t r = pread(fd, buf + n, slice.size - n,
+				slice.offset + n);
+
+			if (r < 0 && errno == EINTR)
+				continue;
+
+			if (r <= 0)
+				return false;
+
+			n += r;
+		}
+
+		buf += slice.size;
+	}
+
+	return true;
+}
+
+// Returns false if the piece couldn't be read, to be tried again later
+static bool
+verify(int piece) {
+	if (!unverified.get(piece) || !verifying.insert(piece).second)
+		return true;
+
+	int size = metadata.piece_size(piece);
+
+	std::vector<libtorrent::file_slice> slices = metadata.map_block(piece,
+		0, size);
+
+	std::vector<std::pair<int,libtorrent::file_slice> > io;
+
+	for (size_t i = 0; i < slices.size(); ++i) {
+		int fd = descriptors.get(slices[i].file_index);
+
+		if (fd < 0)
+			break;
+
+		io.push_back(std::make_pair(fd, slices[i]));
+	}
+
+	std::string expected = metadata.hashes[piece].to_string();
+
+	// Hashing a piece takes a while, so don't block other threads
+	pthread_mutex_unlock(&lock);
+
+	std::vector<char> buf(size);
+
+	bool readable = io.size() == slices.size() &&
+		read_from_disk(io, &buf[0]);
+	bool ok = readable && sha1(&buf[0], size) == expected;
+
+	pthread_mutex_lock(&lock);
+
+	release(io);
+
+	verifying.erase(piece);
+
+	// Not being able to read it says nothing about the data, and a
+	// recheck of everything is what lazy verification is there to avoid
+	if (readable)
+		unverified.unset(piece);
+
+	if (readable && !ok) {
+		printf("%s: piece %d is bad\n", __func__, piece);
+
+		pieces.unset(piece);
+
+		// No way to make libtorrent forget a single piece, so let it
+		// hash everything and download what's missing
+		if (!rechecking) {
+			rechecking = true;
+
+			handle.force_recheck();
+		}
+	}
+
+	pending_iter p = pending.find(piece);
+
+	if (p != pending.end()) {
+		for (reads_iter i = p->second.begin(); i != p->second.end();
+				++i) {
+			(*i)->wake();
+		}
+	}
+
+	return readable;
+}
+
+bool Contents::read(libtorrent::size_type offset, char *buf, int len) {
+	const Metadata::File& f = metadata.files[file];
+
+	if (offset < 0 || offset + len > f.size)
+		return false;
+
+	while (len > 0) {
+		libtorrent::peer_request part = metadata.map_file(file, offset,
+			len);
+
+		std::vector<std::pair<int,libtorrent::file_slice> > io;
+
+		pthread_mutex_lock(&lock);
+
+		bool mapped = map_to_disk(part, io);
+
+		pthread_mutex_unlock(&lock);
+
+		bool ok = mapped && read_from_disk(io, buf);
+
+		pthread_mutex_lock(&lock);
+
+		release(io);
+
+		pthread_mutex_unlock(&lock);
+
+		if (!ok)
+			return false;
+
+		offset += part.length;
+		buf += part.length;
+		len -= part.length;
+	}
+
+	return true;
+}
+
+void Metadata::build(const libtorrent::torrent_info& ti) {
+	piece_length = ti.piece_length();
+	num_pieces = ti.num_pieces();
+	total_size = ti.total_size();
+
+	files.clear();
+
+	for (int i = 0; i < ti.num_files(); ++i) {
+		libtorrent::file_entry e = ti.file_at(i);
+
+		File f;
+
+		f.path = e.path;
+		f.offset = e.offset;
+		f.size = e.size;
+		f.first = e.offset / piece_length;
+		f.last = (e.offset + std::max(e.size, (libtorrent::size_type) 1)
+			- 1) / piece_length;
+
+		files.push_back(f);
+	}
+
+	hashes.clear();
+
+	for (int i = 0; i < num_pieces; ++i)
+		hashes.push_back(ti.hash_for_piece(i));
+}
+
+int Metadata::piece_size(int piece) const {
+	if (piece < num_pieces - 1)
+		return piece_length;
+
+	return total_size - (libtorrent::size_type) piece * piece_length;
+}
+
+libtorrent::peer_request Metadata::map_file(int index,
+		libtorrent::size_type offset, int size) const {
+	const File& file = files[index];
+
+	libtorrent::size_type o = file.offset + offset;
+
+	libtorrent::peer_request part;
+
+	part.piece = o / piece_length;
+	part.start = o % piece_length;
+	part.length = std::min((libtorrent::size_type) std::min(size,
+		piece_size(part.piece) - part.start), file.size - offset);
+
+	return part;
+}
+
+std::vector<libtorrent::file_slice> Metadata::map_block(int piece,
+		int offset, int size) const {
+	std::vector<libtorrent::file_slice> slices;
+
+	libtorrent::size_type o = (libtorrent::size_type) piece *
+		piece_length + offset;
+
+	// Find first file ending after offset
+	int lo = 0, hi = files.size();
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (files[mid].offset + files[mid].size <= o)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (int i = lo; i < (int) files.size() && size > 0; ++i) {
+		if (files[i].size <= 0)
+			continue;
+
+		libtorrent::file_slice slice;
+
+		slice.file_index = i;
+		slice.offset = o - files[i].offset;
+		slice.size = std::min((libtorrent::size_type) size,
+			files[i].size - slice.offset);
+
+		slices.push_back(slice);
+
+		o += slice.size;
+		size -= slice.size;
+	}
+
+	return slices;
+}
+
+int Descriptors::get(int index) {
+	std::map<int,std::list<Entry>::iterator>::iterator i =
+		lookup.find(index);
+
+	if (i != lookup.end()) {
+		entries.splice(entries.begin(), entries, i->second);
+
+		i->second->refs++;
+
+		return i->second->fd;
+	}
+
+	std::string path = handle.save_path() + "/" +
+		metadata.files[index].path;
+
+	int fd = open(path.c_str(), O_RDONLY);
+
+	// Don't remember failures, the file may not have been created yet.
+	// Out of descriptors (EMFILE) just means reading some other way.
+	if (fd < 0)
+		return -1;
+
+	Entry e;
+
+	e.index = index;
+	e.fd = fd;
+	e.refs = 1;
+
+	entries.push_front(e);
+
+	lookup[index] = entries.begin();
+
+	evict();
+
+	return fd;
+}
+
+void Descriptors::put(int index) {
+	std::map<int,std::list<Entry>::iterator>::iterator i =
+		lookup.find(index);
+
+	if (i == lookup.end())
+		return;
+
+	i->second->refs--;
+
+	evict();
+}
+
+void Descriptors::clear() {
+	for (std::list<Entry>::iterator i = entries.begin();
+			i != entries.end(); ++i)
+		close(i->fd);
+
+	entries.clear();
+	lookup.clear();
+}
+
+void Descriptors::evict() {
+	// Close least recently used ones first, but only those not in use
+	std::list<Entry>::iterator i = entries.end();
+
+	for (size_t n = entries.size(); n > capacity && i != entries.begin();) {
+		--i;
+
+		if (i->refs > 0)
+			continue;
+
+		close(i->fd);
 
-pthread_t alert_thread;
+		lookup.erase(i->index);
 
-std::list<Read*> reads;
+		i = entries.erase(i);
 
-// First piece index of the current sliding window
-int cursor;
+		n--;
+	}
+}
 
-std::map<std::string,int> files;
-std::map<std::string,std::set<std::string> > dirs;
+void Cache::resize(size_t n) {
+	capacity = n;
 
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t signal_cond = PTHREAD_COND_INITIALIZER;
+	evict();
+}
 
-static struct btfs_params params;
+bool Cache::get(int piece, boost::shared_array<char>& buffer, int& size) {
+	std::map<int,std::list<Entry>::iterator>::iterator i =
+		index.find(piece);
 
-static bool
-move_to_next_unfinished(int& piece) {
-	for (; piece < handle.get_torrent_info().num_pieces(); piece++) {
-		if (!handle.have_piece(piece))
-			return true;
+	if (i == index.end()) {
+		misses++;
+		return false;
 	}
 
-	return false;
-}
+	// Move to front of LRU list
+	entries.splice(entries.begin(), entries, i->second);
 
-static void
-jump(int piece, int size) {
-	int tail = piece;
+	buffer = i->second->buffer;
+	size = i->second->size;
 
-	if (!move_to_next_unfinished(tail))
-		return;
+	hits++;
+
+	return true;
+}
 
-	cursor = tail;
+void Cache::put(int piece, boost::shared_array<char> buffer, int size) {
+	if ((size_t) size > capacity)
+		return;
 
-	int pl = handle.get_torrent_info().piece_length();
+	std::map<int,std::list<Entry>::iterator>::iterator i =
+		index.find(piece);
 
-	for (int b = 0; b < 16 * pl; b += pl) {
-		handle.piece_priority(tail++, 7);
+	if (i != index.end()) {
+		used -= i->second->size;
+		entries.erase(i->second);
 	}
 
-	for (int o = (tail - piece) * pl; o < size + pl - 1; o += pl) {
-		handle.piece_priority(tail++, 1);
-	}
+	Entry e;
+
+	e.piece = piece;
+	e.buffer = buffer;
+	e.size = size;
+
+	entries.push_front(e);
+
+	index[piece] = entries.begin();
+
+	used += size;
+
+	evict();
 }
 
-static void
-advance() {
-	jump(cursor, 0);
+void Cache::evict() {
+	while (used > capacity && !entries.empty()) {
+		used -= entries.back().size;
+		index.erase(entries.back().piece);
+		entries.pop_back();
+	}
 }
 
-Read::Read(char *buf, int index, int offset, int size) {
-	libtorrent::torrent_info metadata = handle.get_torrent_info();
+Read::Read(char *buf, Stream *s, libtorrent::size_type offset, int size) :
+		stream(s), offset(offset), failures(0) {
+	pthread_cond_init(&cond, NULL);
 
-	libtorrent::file_entry file = metadata.file_at(index);
+	int index = s->file;
+
+	const Metadata::File& file = metadata.files[index];
 
 	while (size > 0 && offset < file.size) {
 		libtorrent::peer_request part = metadata.map_file(index,
 			offset, size);
 
-		part.length = std::min(
-			metadata.piece_size(part.piece) - part.start,
-			part.length);
-
 		parts.push_back(Part(part, buf));
 
 		size -= part.length;
@@ -117,21 +949,119 @@ Read::Read(char *buf, int index, int offset, int size) {
 	}
 }
 
+Read::~Read() {
+	pthread_cond_destroy(&cond);
+}
+
 void Read::copy(int piece, char *buffer, int size) {
+	bool woken = false;
+
 	for (parts_iter i = parts.begin(); i != parts.end(); ++i) {
 		if (i->part.piece == piece && !i->filled)
-			i->filled = (memcpy(i->buf, buffer + i->part.start,
-				i->part.length)) != NULL;
+			woken = i->filled = (memcpy(i->buf,
+				buffer + i->part.start, i->part.length)) != NULL;
+	}
+
+	// Wake up the thread waiting for this read, if any part was filled
+	if (woken)
+		pthread_cond_signal(&cond);
+}
+
+void Read::direct() {
+	// Pairs of file descriptor and file slice for each part
+	std::vector<std::vector<std::pair<int,libtorrent::file_slice> > > io(
+		parts.size());
+
+	for (size_t i = 0; i < parts.size(); ++i) {
+		if (!parts[i].filled && !map_to_disk(parts[i].part, io[i]))
+			io[i].clear();
+	}
+
+	// File descriptors stay open until put back, so don't block other
+	// threads while reading
+	pthread_mutex_unlock(&lock);
+
+	std::vector<bool> ok(parts.size(), false);
+
+	for (size_t i = 0; i < parts.size(); ++i) {
+		if (!io[i].empty())
+			ok[i] = read_from_disk(io[i], parts[i].buf);
+	}
+
+	pthread_mutex_lock(&lock);
+
+	for (size_t i = 0; i < parts.size(); ++i) {
+		release(io[i]);
+
+		if (ok[i])
+			parts[i].filled = true;
+	}
+}
+
+bool Read::splice(std::vector<std::pair<int,libtorrent::file_slice> >& io) {
+	for (parts_iter i = parts.begin(); i != parts.end(); ++i) {
+		if (!map_to_disk(i->part, io))
+			RETV(release(io), false);
+	}
+
+	// FUSE reads from the descriptors after we return. The stream holds
+	// on to the one of its file until it's released.
+	if (!io.empty() && !stream->pinned)
+		stream->pinned = descriptors.get(stream->file) >= 0;
+
+	for (size_t i = 0; i < io.size(); ++i)
+		descriptors.put(io[i].second.file_index);
+
+	// Move sliding window, just like read() does
+	if (size() > 0) {
+		stream->consumed(offset, size());
+		jump(stream, parts.front().part.piece, false);
 	}
+
+	return true;
 }
 
 void Read::trigger() {
 	for (parts_iter i = parts.begin(); i != parts.end(); ++i) {
-		if (handle.have_piece(i->part.piece))
+		if (i->filled || !available(i->part.piece))
+			continue;
+
+		boost::shared_array<char> buffer;
+		int size;
+
+		if (cache.get(i->part.piece, buffer, size))
+			// Piece is cached, no need to bother libtorrent
+			copy(i->part.piece, buffer.get(), size);
+		else if (requested.insert(i->part.piece).second)
+			// Not already on its way. The alert serves all waiters.
 			handle.read_piece(i->part.piece);
 	}
 }
 
+void Read::wake() {
+	pthread_cond_signal(&cond);
+}
+
+bool Read::verified() {
+	bool ok = true;
+
+	for (parts_iter i = parts.begin(); i != parts.end(); ++i) {
+		if (!i->filled && !verify(i->part.piece))
+			ok = false;
+	}
+
+	if (!ok)
+		failures++;
+
+	return ok;
+}
+
+void Read::fail() {
+	failures++;
+
+	pthread_cond_signal(&cond);
+}
+
 bool Read::finished() {
 	for (parts_iter i = parts.begin(); i != parts.end(); ++i) {
 		if (!i->filled)
@@ -155,17 +1085,76 @@ int Read::read() {
 	if (size() <= 0)
 		return 0;
 
-	// Trigger reads of finished pieces
+	// Check adopted pieces before anything is served from them
+	bool stalled = !verified();
+
+	// Read finished pieces directly from disk
+	direct();
+
+	// Trigger reads of finished pieces that couldn't be read from disk
 	trigger();
 
+	for (parts_iter i = parts.begin(); i != parts.end(); ++i) {
+		if (i->filled)
+			continue;
+
+		pending[i->part.piece].push_back(this);
+
+		// Someone is blocked on this piece, so it's due right now
+		deadline(i->part.piece, 0);
+	}
+
+	stream->consumed(offset, size());
+
 	// Move sliding window to first piece to serve this request
-	jump(parts.front().part.piece, size());
+	jump(stream, parts.front().part.piece, !finished());
+
+	int result = size();
+
+	while (!finished()) {
+		// Wait for one of our own pieces to be downloaded or read. An
+		// adopted piece that couldn't be read is tried again right away.
+		if (!stalled)
+			pthread_cond_wait(&cond, &lock);
+
+		stalled = !verified();
+
+		// Disk keeps failing, don't ask libtorrent over and over
+		if (failures > MAX_RETRIES) {
+			result = -EIO;
+			break;
+		}
+
+		direct();
+		trigger();
+	}
+
+	for (parts_iter i = parts.begin(); i != parts.end(); ++i) {
+		pending_iter p = pending.find(i->part.piece);
+
+		if (p == pending.end())
+			continue;
+
+		p->second.remove(this);
+
+		if (p->second.empty())
+			pending.erase(p);
+	}
+
+	return result;
+}
+
+static void
+update_pieces() {
+	libtorrent::torrent_status st = handle.status(
+		libtorrent::torrent_handle::query_pieces);
 
-	while (!finished())
-		// Wait for any piece to downloaded
-		pthread_cond_wait(&signal_cond, &lock);
+	pieces.resize(metadata.num_pieces);
 
-	return size();
+	for (int i = 0; i < st.pieces.size() && i < pieces.size(); ++i) {
+		if (st.pieces.get_bit(i))
+			pieces.set(i);
+	}
 }
 
 static void
@@ -174,13 +1163,20 @@ setup() {
 
 	libtorrent::torrent_info ti = handle.get_torrent_info();
 
+	metadata.build(ti);
+
 	if (params.browse_only)
 		handle.pause();
 
-	for (int i = 0; i < ti.num_files(); ++i) {
-		// Initially, don't download anything
-		handle.file_priority(i, 0);
+	update_pieces();
+
+	// Initially, don't download anything
+	handle.prioritize_files(std::vector<int>(ti.num_files(), 0));
+
+	priorities.assign(metadata.num_pieces, 0);
+	baseline.assign(metadata.num_pieces, 0);
 
+	for (int i = 0; i < ti.num_files(); ++i) {
 		std::string parent("");
 
 		char *p = strdup(ti.file_at(i).path.c_str());
@@ -204,7 +1200,19 @@ setup() {
 
 		// Path <-> file index mapping
 		files["/" + ti.file_at(i).path] = i;
+
+		const Metadata::File& f = metadata.files[i];
+
+		// Small files, like subtitles and covers, are cheap enough
+		// to just fetch at low priority
+		if (f.size > 0 && f.size <= (libtorrent::size_type)
+				params.eager_size << 10) {
+			for (int p = f.first; p <= f.last; p++)
+				baseline[p] = 1;
+		}
 	}
+
+	update();
 }
 
 static void
@@ -213,14 +1221,27 @@ handle_read_piece_alert(libtorrent::read_piece_alert *a) {
 
 	pthread_mutex_lock(&lock);
 
-	for (reads_iter i = reads.begin(); i != reads.end(); ++i) {
-		(*i)->copy(a->piece, a->buffer.get(), a->size);
+	requested.erase(a->piece);
+
+	if (!a->ec)
+		cache.put(a->piece, a->buffer, a->size);
+
+	pending_iter p = pending.find(a->piece);
+
+	if (p != pending.end()) {
+		for (reads_iter i = p->second.begin(); i != p->second.end();
+				++i) {
+			if (a->ec)
+				// No data. Its trigger() asks for the piece again,
+				// a few times.
+				(*i)->fail();
+			else
+				// Wakes up the thread waiting for the read
+				(*i)->copy(a->piece, a->buffer.get(), a->size);
+		}
 	}
 
 	pthread_mutex_unlock(&lock);
-
-	// Wake up all threads waiting for download
-	pthread_cond_broadcast(&signal_cond);
 }
 
 static void
@@ -229,12 +1250,121 @@ handle_piece_finished_alert(libtorrent::piece_finished_alert *a) {
 
 	pthread_mutex_lock(&lock);
 
-	for (reads_iter i = reads.begin(); i != reads.end(); ++i) {
-		(*i)->trigger();
+	pieces.set(a->piece_index);
+
+	deadlines.erase(a->piece_index);
+
+	pending_iter p = pending.find(a->piece_index);
+
+	if (p != pending.end()) {
+		for (reads_iter i = p->second.begin(); i != p->second.end();
+				++i) {
+			// Let the reading thread fetch the piece itself
+			(*i)->wake();
+		}
+	}
+
+	// Advance sliding windows
+	update();
+
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+handle_torrent_checked_alert(libtorrent::torrent_checked_alert *a) {
+	//printf("%s\n", __func__);
+
+	pthread_mutex_lock(&lock);
+
+	// Pick up pieces found when checking existing files
+	if (pieces.size() > 0)
+		update_pieces();
+
+	// Everything has been hashed by libtorrent now
+	if (rechecking) {
+		rechecking = false;
+
+		unverified.resize(0);
+	}
+
+	for (pending_iter p = pending.begin(); p != pending.end(); ++p) {
+		if (!pieces.get(p->first))
+			continue;
+
+		for (reads_iter i = p->second.begin(); i != p->second.end();
+				++i) {
+			(*i)->wake();
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+handle_save_resume_data_alert(libtorrent::save_resume_data_alert *a) {
+	//printf("%s\n", __func__);
+
+	std::vector<char> buf;
+
+	pthread_mutex_lock(&lock);
+
+	libtorrent::entry *have = a->resume_data ?
+		a->resume_data->find_key("pieces") : NULL;
+
+	// Pieces trusted without hashing must not be trusted for good by the
+	// next mount. One byte per piece, lowest bit set if we have it.
+	if (have && unverified.any()) {
+		std::string& p = have->string();
+
+		for (int i = 0; i < (int) p.size(); ++i) {
+			if (unverified.get(i))
+				p[i] &= ~1;
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	if (a->resume_data)
+		libtorrent::bencode(std::back_inserter(buf), *a->resume_data);
+
+	// Set once in main(), so no need for the lock while syncing to disk
+	std::string tmp = resume_file + ".tmp";
+
+	FILE *f = resume_file.length() > 0 && buf.size() > 0 ?
+		fopen(tmp.c_str(), "wb") : NULL;
+
+	if (f) {
+		bool ok = fwrite(&buf[0], 1, buf.size(), f) == buf.size() &&
+			fflush(f) == 0 && fsync(fileno(f)) == 0;
+
+		fclose(f);
+
+		// Replace the previous checkpoint only with a complete one
+		if (!ok || rename(tmp.c_str(), resume_file.c_str()) < 0) {
+			fprintf(stderr, "Failed to write resume data\n");
+			unlink(tmp.c_str());
+		}
 	}
 
-	// Advance sliding window
-	advance();
+	pthread_mutex_lock(&lock);
+
+	resume_pending--;
+
+	pthread_cond_broadcast(&resume_cond);
+
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+handle_save_resume_data_failed_alert(
+		libtorrent::save_resume_data_failed_alert *a) {
+	//printf("%s\n", __func__);
+
+	pthread_mutex_lock(&lock);
+
+	resume_pending--;
+
+	pthread_cond_broadcast(&resume_cond);
 
 	pthread_mutex_unlock(&lock);
 }
@@ -271,14 +1401,129 @@ handle_metadata_received_alert(libtorrent::metadata_received_alert *a) {
 	pthread_mutex_unlock(&lock);
 }
 
+static void
+probe_indexes() {
+	pthread_mutex_lock(&lock);
+
+	// Each index at most once per call
+	std::set<int> tried;
+
+	for (;;) {
+		std::map<int,Index>::iterator i = indexes.begin();
+
+		// Next index whose missing data has arrived
+		for (; i != indexes.end(); ++i) {
+			if (!i->second.complete && !tried.count(i->first) &&
+					now() >= reprobe[i->first] && downloaded(
+					metadata.files[i->first], i->second.missing))
+				break;
+		}
+
+		if (i == indexes.end())
+			break;
+
+		int file = i->first;
+
+		Index index = i->second;
+
+		range before = index.missing;
+
+		tried.insert(file);
+
+		const Metadata::File& f = metadata.files[file];
+
+		int pl = metadata.piece_length;
+
+		// Adopted pieces can't be read before they're hashed. Nothing
+		// else would hash them, no stream is blocked on them.
+		for (libtorrent::size_type o = index.missing.first;
+				o < index.missing.second; o = (o / pl + 1) * pl)
+			verify((f.offset + o) / pl);
+
+		pthread_mutex_unlock(&lock);
+
+		// Can read megabytes of index, so don't hold the lock meanwhile
+		Contents contents(file);
+
+		index.probe(contents, f.size);
+
+		pthread_mutex_lock(&lock);
+
+		// Got nowhere, like when the data can't be read. Leave it for a
+		// while rather than reading the same megabytes over and over.
+		if (!index.complete && index.missing == before)
+			reprobe[file] = now() + REPROBE_SECONDS;
+
+		i = indexes.find(file);
+
+		if (i != indexes.end()) {
+			i->second = index;
+
+			// Fetch what it found, or what it's still missing
+			update();
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+sample_download_rate() {
+	if (!handle.is_valid())
+		return;
+
+	libtorrent::torrent_status st = handle.status(0);
+
+	pthread_mutex_lock(&lock);
+
+	download_rate = st.download_payload_rate;
+
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+checkpoint() {
+	if (resume_file.length() <= 0 || !handle.is_valid())
+		return;
+
+	pthread_mutex_lock(&lock);
+
+	// Answered with an alert, which writes it to disk
+	if (metadata.num_pieces > 0 && handle.need_save_resume_data()) {
+		resume_pending++;
+
+		handle.save_resume_data();
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
 static void*
 alert_queue_loop(void *data) {
-	int oldstate, oldtype;
-
-	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &oldstate);
-	pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, &oldtype);
+	double sampled = 0, checkpointed = now();
 
 	while (1) {
+		pthread_mutex_lock(&lock);
+
+		bool stop = stopping;
+
+		pthread_mutex_unlock(&lock);
+
+		if (stop)
+			break;
+
+		if (now() - sampled >= 1) {
+			sample_download_rate();
+			probe_indexes();
+			sampled = now();
+		}
+
+		if (params.checkpoint > 0 &&
+				now() - checkpointed >= params.checkpoint) {
+			checkpoint();
+			checkpointed = now();
+		}
+
 		if (!session->wait_for_alert(libtorrent::seconds(1)))
 			continue;
 
@@ -292,6 +1537,11 @@ alert_queue_loop(void *data) {
 		case libtorrent::piece_finished_alert::alert_type:
 			handle_piece_finished_alert(
 				(libtorrent::piece_finished_alert *) a.get());
+			probe_indexes();
+			break;
+		case libtorrent::torrent_checked_alert::alert_type:
+			handle_torrent_checked_alert(
+				(libtorrent::torrent_checked_alert *) a.get());
 			break;
 		case libtorrent::metadata_failed_alert::alert_type:
 			handle_metadata_failed_alert(
@@ -305,6 +1555,15 @@ alert_queue_loop(void *data) {
 			handle_torrent_added_alert(
 				(libtorrent::torrent_added_alert *) a.get());
 			break;
+		case libtorrent::save_resume_data_alert::alert_type:
+			handle_save_resume_data_alert(
+				(libtorrent::save_resume_data_alert *) a.get());
+			break;
+		case libtorrent::save_resume_data_failed_alert::alert_type:
+			handle_save_resume_data_failed_alert(
+				(libtorrent::save_resume_data_failed_alert *)
+				a.get());
+			break;
 		case libtorrent::add_torrent_alert::alert_type:
 			// TODO
 			break;
@@ -317,14 +1576,44 @@ alert_queue_loop(void *data) {
 	return NULL;
 }
 
-static bool
-is_dir(const char *path) {
-	return dirs.find(path) != dirs.end();
-}
+static bool
+is_dir(const char *path) {
+	return dirs.find(path) != dirs.end();
+}
+
+static bool
+is_file(const char *path) {
+	return files.find(path) != files.end();
+}
+
+// Index of the file after path in its directory, in sorted order and with
+// the same extension, or -1
+static int
+next_file(const std::string& path) {
+	size_t slash = path.rfind('/');
+
+	std::string parent = slash > 0 ? path.substr(0, slash) : "/";
+	std::string name = path.substr(slash + 1);
+
+	size_t dot = name.rfind('.');
+
+	std::string ext = dot != std::string::npos ? name.substr(dot) : "";
+
+	std::set<std::string>& children = dirs[parent];
+
+	for (std::set<std::string>::iterator i = children.upper_bound(name);
+			i != children.end(); ++i) {
+		std::string p = (parent == "/" ? "" : parent) + "/" + *i;
+
+		if (!is_file(p.c_str()))
+			continue;
+
+		if (i->length() >= ext.length() && strcasecmp(i->c_str() +
+				i->length() - ext.length(), ext.c_str()) == 0)
+			return files[p];
+	}
 
-static bool
-is_file(const char *path) {
-	return files.find(path) != files.end();
+	return -1;
 }
 
 static int
@@ -342,11 +1631,8 @@ btfs_getattr(const char *path, struct stat *stbuf) {
 	if (strcmp(path, "/") == 0 || is_dir(path)) {
 		stbuf->st_mode = S_IFDIR | 0755;
 	} else {
-		libtorrent::file_entry file =
-			handle.get_torrent_info().file_at(files[path]);
-
 		stbuf->st_mode = S_IFREG | 0444;
-		stbuf->st_size = file.size;
+		stbuf->st_size = metadata.files[files[path]].size;
 	}
 
 	pthread_mutex_unlock(&lock);
@@ -373,11 +1659,76 @@ btfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		filler(buf, i->c_str(), NULL, 0);
 	}
 
+	// File managers and indexers open everything they list. Without
+	// metadata there's nothing listed yet, so try again next time.
+	if (params.readdir_prefetch > 0 && metadata.num_pieces > 0 &&
+			listed.insert(path).second) {
+		int n = 0;
+
+		for (std::set<std::string>::iterator i = dirs[path].begin();
+				i != dirs[path].end() &&
+				n < params.readdir_prefetch; ++i) {
+			std::string p = (strcmp(path, "/") == 0 ? "" : path) +
+				std::string("/") + *i;
+
+			if (!is_file(p.c_str()))
+				continue;
+
+			const Metadata::File& f = metadata.files[files[p]];
+
+			// First piece at low priority, for headers
+			if (f.size > 0)
+				baseline[f.first] = std::max(baseline[f.first], 1);
+
+			n++;
+		}
+
+		update();
+	}
+
 	pthread_mutex_unlock(&lock);
 
 	return 0;
 }
 
+#ifndef __APPLE__
+static int
+btfs_getxattr(const char *path, const char *key, char *value, size_t len) {
+	char xattr[32];
+
+	if (!is_dir(path) && !is_file(path) && strcmp(path, "/") != 0)
+		return -ENOENT;
+
+	// Counters live on the mount point only
+	if (strcmp(path, "/") != 0)
+		return -ENOTSUP;
+
+	pthread_mutex_lock(&lock);
+
+	if (strcmp(key, "user.btfs.cache_hits") == 0)
+		snprintf(xattr, sizeof (xattr), "%llu", cache.hits);
+	else if (strcmp(key, "user.btfs.cache_misses") == 0)
+		snprintf(xattr, sizeof (xattr), "%llu", cache.misses);
+	else
+		RETV(pthread_mutex_unlock(&lock), -ENOTSUP);
+
+	pthread_mutex_unlock(&lock);
+
+	size_t n = strlen(xattr);
+
+	// Caller only wants to know the size
+	if (len == 0)
+		return n;
+
+	if (len < n)
+		return -ERANGE;
+
+	memcpy(value, xattr, n);
+
+	return n;
+}
+#endif
+
 static int
 btfs_open(const char *path, struct fuse_file_info *fi) {
 	if (!is_dir(path) && !is_file(path))
@@ -389,6 +1740,49 @@ btfs_open(const char *path, struct fuse_file_info *fi) {
 	if ((fi->flags & 3) != O_RDONLY)
 		return -EACCES;
 
+	pthread_mutex_lock(&lock);
+
+	Stream *s = new Stream(files[path]);
+
+	s->next = next_file(path);
+
+	// Parse container index of media files
+	if (is_media(path) && indexes.find(s->file) == indexes.end())
+		indexes[s->file] = Index();
+
+	streams.push_back(s);
+
+	fi->fh = (uint64_t) s;
+
+	// Start fetching header and trailer before they're read
+	update();
+
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+static int
+btfs_release(const char *path, struct fuse_file_info *fi) {
+	Stream *s = (Stream *) fi->fh;
+
+	if (!s)
+		return 0;
+
+	pthread_mutex_lock(&lock);
+
+	streams.remove(s);
+
+	if (s->pinned)
+		descriptors.put(s->file);
+
+	delete s;
+
+	// Drop its window
+	update();
+
+	pthread_mutex_unlock(&lock);
+
 	return 0;
 }
 
@@ -408,15 +1802,11 @@ btfs_read(const char *path, char *buf, size_t size, off_t offset,
 
 	pthread_mutex_lock(&lock);
 
-	Read *r = new Read(buf, files[path], offset, size);
-
-	reads.push_back(r);
+	Read *r = new Read(buf, (Stream *) fi->fh, offset, size);
 
 	// Wait for read to finish
 	int s = r->read();
 
-	reads.remove(r);
-
 	delete r;
 
 	pthread_mutex_unlock(&lock);
@@ -424,6 +1814,87 @@ btfs_read(const char *path, char *buf, size_t size, off_t offset,
 	return s;
 }
 
+#if FUSE_VERSION >= 29
+static int
+btfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+		off_t offset, struct fuse_file_info *fi) {
+	if (!is_dir(path) && !is_file(path))
+		return -ENOENT;
+
+	if (is_dir(path))
+		return -EISDIR;
+
+	if (params.browse_only)
+		return -EACCES;
+
+	std::vector<std::pair<int,libtorrent::file_slice> > io;
+
+	pthread_mutex_lock(&lock);
+
+	Read r(NULL, (Stream *) fi->fh, offset, size);
+
+	bool spliced = r.splice(io) && !io.empty();
+
+	pthread_mutex_unlock(&lock);
+
+	if (spliced) {
+		// All data is on disk. Let FUSE splice it from the files.
+		struct fuse_bufvec *bv = (struct fuse_bufvec *) malloc(
+			sizeof (struct fuse_bufvec) +
+			(io.size() - 1) * sizeof (struct fuse_buf));
+
+		if (!bv)
+			return -ENOMEM;
+
+		bv->count = io.size();
+		bv->idx = 0;
+		bv->off = 0;
+
+		for (size_t i = 0; i < io.size(); ++i) {
+			bv->buf[i].size = io[i].second.size;
+			bv->buf[i].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD |
+				FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY);
+			bv->buf[i].mem = NULL;
+			bv->buf[i].fd = io[i].first;
+			bv->buf[i].pos = io[i].second.offset;
+		}
+
+		*bufp = bv;
+
+		return 0;
+	}
+
+	// Not everything is on disk. Fall back to a regular read.
+	char *buf = (char *) malloc(size);
+
+	if (!buf)
+		return -ENOMEM;
+
+	int s = btfs_read(path, buf, size, offset, fi);
+
+	if (s < 0)
+		RETV(free(buf), s);
+
+	struct fuse_bufvec *bv = (struct fuse_bufvec *) malloc(sizeof (*bv));
+
+	if (!bv)
+		RETV(free(buf), -ENOMEM);
+
+	bv->count = 1;
+	bv->idx = 0;
+	bv->off = 0;
+	bv->buf[0].size = s;
+	bv->buf[0].flags = (enum fuse_buf_flags) 0;
+	bv->buf[0].mem = buf;
+	bv->buf[0].fd = -1;
+	bv->buf[0].pos = 0;
+
+	*bufp = bv;
+
+	return 0;
+}
+#endif
+
 static void *
 btfs_init(struct fuse_conn_info *conn) {
 	pthread_mutex_lock(&lock);
@@ -450,6 +1921,11 @@ btfs_init(struct fuse_conn_info *conn) {
 		libtorrent::session::add_default_plugins,
 		alerts);
 
+#ifdef FUSE_CAP_SPLICE_WRITE
+	// Allow replies to be spliced from the files on disk
+	conn->want |= conn->capable & FUSE_CAP_SPLICE_WRITE;
+#endif
+
 	pthread_create(&alert_thread, NULL, alert_queue_loop, NULL);
 
 #ifndef __APPLE__
@@ -462,9 +1938,15 @@ btfs_init(struct fuse_conn_info *conn) {
 	se.announce_to_all_trackers = true;
 	se.announce_to_all_tiers = true;
 
+	// Don't hold back written blocks in libtorrent's disk cache. A
+	// finished piece must be in its files, as it's read from there.
+	se.cache_size = 0;
+
 	session->set_settings(se);
 	session->async_add_torrent(*p);
 
+	cache.resize((size_t) params.cache_size << 20);
+
 	pthread_mutex_unlock(&lock);
 
 	return NULL;
@@ -474,17 +1956,53 @@ static void
 btfs_destroy(void *user_data) {
 	pthread_mutex_lock(&lock);
 
-	pthread_cancel(alert_thread);
+	if (resume_file.length() > 0 && handle.is_valid() &&
+			metadata.num_pieces > 0) {
+		struct timespec ts;
+
+		ts.tv_sec = time(NULL) + 10;
+		ts.tv_nsec = 0;
+
+		resume_pending++;
+
+		handle.save_resume_data();
+
+		// Alert thread writes it to disk
+		while (resume_pending > 0) {
+			if (pthread_cond_timedwait(&resume_cond, &lock, &ts) ==
+					ETIMEDOUT) {
+				fprintf(stderr, "Failed to save resume data\n");
+				break;
+			}
+		}
+	}
+
+	// The alert thread takes the lock, so let go of it while it stops.
+	// It waits for alerts for at most a second at a time.
+	stopping = true;
+
+	pthread_mutex_unlock(&lock);
+
 	pthread_join(alert_thread, NULL);
 
+	pthread_mutex_lock(&lock);
+
 	std::string path = handle.save_path();
 
+	descriptors.clear();
+
+	printf("Piece cache: %llu hits, %llu misses\n", cache.hits,
+		cache.misses);
+
+	bool keep = params.keep || params.cache_dir;
+
 	session->remove_torrent(handle,
-		params.keep ? 0 : libtorrent::session::delete_files);
+		keep ? 0 : libtorrent::session::delete_files);
 
 	delete session;
 
-	rmdir(path.c_str());
+	if (!params.cache_dir)
+		rmdir(path.c_str());
 
 	pthread_mutex_unlock(&lock);
 }
@@ -530,6 +2048,296 @@ populate_target(libtorrent::add_torrent_params& p, char *arg) {
 	return p.save_path.length() > 0;
 }
 
+static bool
+on_disk(int fd, libtorrent::size_type offset, libtorrent::size_type size) {
+	struct stat st;
+
+	if (fstat(fd, &st) < 0 || st.st_size < offset + size)
+		return false;
+
+#ifdef SEEK_HOLE
+	// Sparse files have the right size long before all data is there
+	off_t hole = lseek(fd, offset, SEEK_HOLE);
+
+	if (hole >= 0 && hole < offset + size)
+		return false;
+#endif
+
+	return true;
+}
+
+static bool
+read_slice(const std::string& path, const libtorrent::file_slice& slice, char *buf) {
+	int fd = open(path.c_str(), O_RDONLY);
+
+	if (fd < 0)
+		return false;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, slice.offset, slice.size, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	std::vector<std::pair<int,libtorrent::file_slice> > io(1,
+		std::make_pair(fd, slice));
+
+	bool ok = read_from_disk(io, buf);
+
+	close(fd);
+
+	return ok;
+}
+
+static void *
+check_loop(void *data) {
+	Check *c = (Check *) data;
+
+	const libtorrent::torrent_info& ti = *c->ti;
+
+	std::vector<char> buf;
+
+	for (;;) {
+		int first = __sync_fetch_and_add(&c->next, c->span);
+
+		if (first >= ti.num_pieces())
+			break;
+
+		int last = std::min(first + c->span, ti.num_pieces());
+
+		for (int i = first; i < last;) {
+			if (!c->have[i]) {
+				i++;
+				continue;
+			}
+
+			// Run of pieces that are there, read in one go
+			int j = i, size = 0;
+
+			while (j < last && c->have[j])
+				size += ti.piece_size(j++);
+
+			std::vector<libtorrent::file_slice> slices = ti.map_block(
+				i, 0, size);
+
+			buf.resize(size);
+
+			bool ok = true;
+
+			char *b = &buf[0];
+
+			for (size_t k = 0; ok && k < slices.size(); ++k) {
+				ok = read_slice(c->paths[slices[k].file_index],
+					slices[k], b);
+
+				b += slices[k].size;
+			}
+
+			b = &buf[0];
+
+			for (; i < j; ++i) {
+				c->have[i] = ok && sha1(b, ti.piece_size(i)) ==
+					ti.hash_for_piece(i).to_string();
+
+				b += ti.piece_size(i);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void
+check(Check& c, int threads) {
+	c.next = 0;
+	c.span = std::max(CHECK_CHUNK / c.ti->piece_length(), 1);
+
+	std::vector<pthread_t> t(threads);
+
+	int n = 0;
+
+	for (int i = 0; i < threads; ++i) {
+		if (pthread_create(&t[n], NULL, check_loop, (void *) &c) == 0)
+			n++;
+	}
+
+	// Do it here if no thread could be started
+	if (n <= 0)
+		check_loop((void *) &c);
+
+	for (int i = 0; i < n; ++i)
+		pthread_join(t[i], NULL);
+}
+
+static void
+adopt(libtorrent::add_torrent_params& p, std::vector<char>& resume) {
+	const libtorrent::torrent_info& ti = *p.ti;
+
+	Check c;
+
+	c.ti = &ti;
+	c.have.assign(ti.num_pieces(), 1);
+
+	libtorrent::entry e;
+
+	libtorrent::entry::list_type& sizes = e["file sizes"].list();
+
+	int pl = ti.piece_length();
+
+	// One file open at a time, there may be more than descriptors
+	for (int i = 0; i < ti.num_files(); ++i) {
+		libtorrent::file_entry f = ti.file_at(i);
+
+		c.paths.push_back(p.save_path + "/" + f.path);
+
+		struct stat st;
+
+		int fd = open(c.paths[i].c_str(), O_RDONLY);
+
+		if (fd < 0 || fstat(fd, &st) < 0)
+			memset(&st, 0, sizeof (st));
+
+		int first = f.offset / pl;
+		int last = f.size > 0 ? (f.offset + f.size - 1) / pl : first - 1;
+
+		// Missing data is missing, no need to hash it
+		for (int j = first; j <= last; ++j) {
+			libtorrent::size_type from = std::max(f.offset,
+				(libtorrent::size_type) j * pl);
+			libtorrent::size_type to = std::min(f.offset + f.size,
+				(libtorrent::size_type) j * pl + ti.piece_size(j));
+
+			if (fd < 0 || !on_disk(fd, from - f.offset, to - from))
+				c.have[j] = 0;
+		}
+
+		if (fd >= 0)
+			close(fd);
+
+		// Has to match the files, or libtorrent checks them anyway
+		libtorrent::entry::list_type file;
+
+		file.push_back(libtorrent::entry(
+			(libtorrent::size_type) st.st_size));
+		file.push_back(libtorrent::entry(
+			(libtorrent::size_type) st.st_mtime));
+
+		sizes.push_back(file);
+	}
+
+	double start = now();
+
+	if (!params.lazy_verify)
+		check(c, params.check_threads);
+
+	unverified.resize(ti.num_pieces());
+
+	int n = 0;
+
+	for (int i = 0; i < ti.num_pieces(); ++i) {
+		if (!c.have[i])
+			continue;
+
+		if (params.lazy_verify)
+			unverified.set(i);
+
+		n++;
+	}
+
+	if (n <= 0)
+		return;
+
+	e["file-format"] = std::string("libtorrent resume file");
+	e["file-version"] = (libtorrent::size_type) 1;
+	e["info-hash"] = ti.info_hash().to_string();
+	e["pieces"] = std::string(c.have.begin(), c.have.end());
+
+	libtorrent::bencode(std::back_inserter(resume), e);
+
+	if (params.lazy_verify)
+		printf("Adopted %d of %d pieces, to verify on first read\n", n,
+			ti.num_pieces());
+	else
+		printf("Verified %d of %d pieces in %.1f seconds\n", n,
+			ti.num_pieces(), now() - start);
+}
+
+static bool
+populate_cache(libtorrent::add_torrent_params& p, const char *arg) {
+	if (mkdir(arg, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0) {
+		if (errno != EEXIST)
+			RETV(fprintf(stderr, "Failed to create cache: %m\n"),
+				false);
+	}
+
+	char *x = realpath(arg, NULL);
+
+	if (!x)
+		RETV(fprintf(stderr, "Failed to expand cache: %m\n"), false);
+
+	libtorrent::sha1_hash ih = p.ti ? p.ti->info_hash() : p.info_hash;
+
+	// Same torrent, same place, every time
+	std::string hash = libtorrent::to_hex(ih.to_string());
+	std::string target = std::string(x) + "/" + hash;
+
+	free(x);
+
+	if (mkdir(target.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0) {
+		if (errno != EEXIST)
+			RETV(fprintf(stderr, "Failed to create target: %m\n"),
+				false);
+	}
+
+	// Held until exit, two mounts must not share the data or resume file
+	int fd = open((target + ".lock").c_str(), O_RDWR | O_CREAT,
+		S_IRUSR | S_IWUSR);
+
+	if (fd < 0)
+		RETV(fprintf(stderr, "Failed to create lock: %m\n"), false);
+
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		if (errno == EWOULDBLOCK)
+			fprintf(stderr, "Torrent already mounted from cache\n");
+		else
+			fprintf(stderr, "Failed to lock cache: %m\n");
+
+		close(fd);
+
+		return false;
+	}
+
+	p.save_path = target;
+
+	resume_file = target + ".resume";
+
+	static std::vector<char> resume;
+
+	FILE *f = fopen(resume_file.c_str(), "rb");
+
+	if (f) {
+		char buf[4096];
+
+		for (size_t n; (n = fread(buf, 1, sizeof (buf), f)) > 0;)
+			resume.insert(resume.end(), buf, buf + n);
+
+		fclose(f);
+	} else if ((params.lazy_verify || params.check_threads > 0) && p.ti) {
+		// Data without resume data, e.g. copied in or left by a crash.
+		// Trust it for now, or hash it faster than libtorrent would.
+		adopt(p, resume);
+	}
+
+	if (resume.empty())
+		return true;
+
+#if LIBTORRENT_VERSION_NUM < 10000
+	p.resume_data = &resume;
+#else
+	p.resume_data = resume;
+#endif
+
+	return true;
+}
+
 static size_t
 handle_http(void *contents, size_t size, size_t nmemb, void *userp) {
 	Array *output = (Array *) userp;
@@ -622,6 +2430,16 @@ static const struct fuse_opt btfs_opts[] = {
 	BTFS_OPT("--browse-only", browse_only, 1),
 	BTFS_OPT("-k",            keep,        1),
 	BTFS_OPT("--keep",        keep,        1),
+	BTFS_OPT("--cache-size=%d", cache_size, 0),
+	BTFS_OPT("--deadlines",   deadlines,   1),
+	BTFS_OPT("--prefetch=%d", prefetch,    0),
+	BTFS_OPT("--buffer-seconds=%d", buffer_seconds, 0),
+	BTFS_OPT("--eager-size=%d", eager_size, 0),
+	BTFS_OPT("--readdir-prefetch=%d", readdir_prefetch, 0),
+	BTFS_OPT("--cache-dir=%s", cache_dir, 0),
+	BTFS_OPT("--checkpoint=%d", checkpoint, 0),
+	BTFS_OPT("--lazy-verify", lazy_verify, 1),
+	BTFS_OPT("--check-threads=%d", check_threads, 0),
 	FUSE_OPT_END
 };
 
@@ -650,13 +2468,32 @@ main(int argc, char *argv[]) {
 
 	btfs_ops.getattr = btfs_getattr;
 	btfs_ops.readdir = btfs_readdir;
+#ifndef __APPLE__
+	btfs_ops.getxattr = btfs_getxattr;
+#endif
 	btfs_ops.open = btfs_open;
+	btfs_ops.release = btfs_release;
 	btfs_ops.read = btfs_read;
+#if FUSE_VERSION >= 29
+	btfs_ops.read_buf = btfs_read_buf;
+#endif
 	btfs_ops.init = btfs_init;
 	btfs_ops.destroy = btfs_destroy;
 
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
+	// Default size of piece cache, in MiB
+	params.cache_size = 64;
+
+	// Default size of header and trailer to fetch on open, in KiB
+	params.prefetch = 512;
+
+	// Default interval of resume data checkpoints, in seconds
+	params.checkpoint = 60;
+
+	// Hash cached data on all cores by default
+	params.check_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
 	if (fuse_opt_parse(&args, &params, btfs_opts, btfs_process_arg))
 		RETV(fprintf(stderr, "Failed to parse options\n"), -1);
 
@@ -683,6 +2520,16 @@ main(int argc, char *argv[]) {
 		printf("    --help -h              show this message\n");
 		printf("    --browse-only -b       download metadata only\n");
 		printf("    --keep -k              keep files after unmount\n");
+		printf("    --cache-size=N         piece cache size in MiB (64)\n");
+		printf("    --deadlines            time-critical piece scheduling\n");
+		printf("    --prefetch=N           head/tail KiB to fetch on open (512)\n");
+		printf("    --buffer-seconds=N     read-ahead N seconds of media files\n");
+		printf("    --eager-size=N         fetch files up to N KiB right away\n");
+		printf("    --readdir-prefetch=N   fetch first piece of N files listed\n");
+		printf("    --cache-dir=DIR        keep and reuse data per torrent in DIR\n");
+		printf("    --checkpoint=N         save resume data every N seconds (60)\n");
+		printf("    --lazy-verify          hash cached pieces on first read\n");
+		printf("    --check-threads=N      threads hashing cached pieces (cores)\n");
 		printf("\n");
 
 		// Let FUSE print more help
@@ -697,7 +2544,7 @@ main(int argc, char *argv[]) {
 	p.flags &= ~libtorrent::add_torrent_params::flag_auto_managed;
 	p.flags &= ~libtorrent::add_torrent_params::flag_paused;
 
-	if (!populate_target(p, NULL))
+	if (!params.cache_dir && !populate_target(p, NULL))
 		return -1;
 
 	curl_global_init(CURL_GLOBAL_ALL);
@@ -705,6 +2552,10 @@ main(int argc, char *argv[]) {
 	if (!populate_metadata(p, params.metadata))
 		return -1;
 
+	// Needs the info-hash, so after metadata
+	if (params.cache_dir && !populate_cache(p, params.cache_dir))
+		return -1;
+
 	fuse_main(args.argc, args.argv, &btfs_ops, (void *) &p);
 
 	curl_global_cleanup();
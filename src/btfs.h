@@ -20,16 +20,25 @@ along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef BTFS_H
 #define BTFS_H
 
+#include <boost/shared_array.hpp>
+
 #include <libtorrent/peer_request.hpp>
+#include <libtorrent/file_storage.hpp>
+#include <libtorrent/torrent_info.hpp>
+
+#include "media.h"
 
 namespace btfs
 {
 
 class Part;
 class Read;
+class Stream;
 
 typedef std::vector<Part>::iterator parts_iter;
 typedef std::list<Read*>::iterator reads_iter;
+typedef std::map<int,std::list<Read*> >::iterator pending_iter;
+typedef std::list<Stream*>::iterator streams_iter;
 
 class Part
 {
@@ -48,15 +57,91 @@ private:
 	bool filled;
 };
 
+class Stream
+{
+public:
+	enum Pattern {
+		SEQUENTIAL,
+		STRIDED,
+		RANDOM,
+	};
+
+	// Number of recent reads to classify the access pattern from
+	static const int HISTORY = 4;
+
+	Stream(int index) : file(index), next(-1), cursor(-1), rate(0),
+			pattern(SEQUENTIAL), stride(0), interval(0), reads(0),
+			jumped(-1), jumped_pattern(SEQUENTIAL), pinned(false),
+			bytes(0), since(0), last(0) {
+	}
+
+	void consumed(libtorrent::size_type offset, int size);
+
+	int file;
+
+	// File likely to be read after this one, or -1
+	int next;
+
+	// First piece index of this stream's sliding window, or -1 before
+	// the first read
+	int cursor;
+
+	// Measured read rate, in bytes per second
+	double rate;
+
+	Pattern pattern;
+
+	// Distance between reads, when strided
+	libtorrent::size_type stride;
+
+	// Average time between reads, in seconds
+	double interval;
+
+	// Most recent reads first
+	libtorrent::size_type offsets[HISTORY];
+	int lengths[HISTORY];
+
+	// Number of valid entries in history
+	int reads;
+
+	// Piece and pattern of the read that last moved the window
+	int jumped;
+	Pattern jumped_pattern;
+
+	// Holds a reference to the descriptor of its file, for splicing
+	bool pinned;
+
+private:
+	void classify();
+
+	// Bytes read since the start of the current sample
+	double bytes;
+
+	double since;
+
+	// Time of last read
+	double last;
+};
+
 class Read
 {
 public:
-	Read(char *buf, int index, int offset, int size);
+	Read(char *buf, Stream *s, libtorrent::size_type offset, int size);
+
+	~Read();
 
 	void copy(int piece, char *buffer, int size);
 
+	void direct();
+
+	bool splice(std::vector<std::pair<int,libtorrent::file_slice> >& io);
+
 	void trigger();
 
+	void wake();
+
+	void fail();
+
 	bool finished();
 
 	int size();
@@ -64,7 +149,204 @@ public:
 	int read();
 
 private:
+	bool verified();
+
 	std::vector<Part> parts;
+
+	Stream *stream;
+
+	// Offset of read in file
+	libtorrent::size_type offset;
+
+	// Number of failed attempts to read a piece
+	int failures;
+
+	// Signalled when any of the parts is filled
+	pthread_cond_t cond;
+};
+
+class Metadata
+{
+public:
+	struct File {
+		std::string path;
+
+		// Offset of file in torrent
+		libtorrent::size_type offset;
+
+		libtorrent::size_type size;
+
+		// First and last piece with data of this file
+		int first;
+		int last;
+	};
+
+	Metadata() : piece_length(0), num_pieces(0), total_size(0) {
+	}
+
+	void build(const libtorrent::torrent_info& ti);
+
+	int piece_size(int piece) const;
+
+	libtorrent::peer_request map_file(int index,
+		libtorrent::size_type offset, int size) const;
+
+	std::vector<libtorrent::file_slice> map_block(int piece, int offset,
+		int size) const;
+
+	std::vector<File> files;
+
+	// SHA-1 of each piece, to check adopted data against
+	std::vector<libtorrent::sha1_hash> hashes;
+
+	int piece_length;
+
+	int num_pieces;
+
+	libtorrent::size_type total_size;
+};
+
+class Contents : public Source
+{
+public:
+	Contents(int index) : file(index) {
+	}
+
+	bool read(libtorrent::size_type offset, char *buf, int len);
+
+private:
+	int file;
+};
+
+class Cache
+{
+public:
+	Cache() : capacity(0), used(0), hits(0), misses(0) {
+	}
+
+	void resize(size_t n);
+
+	bool get(int piece, boost::shared_array<char>& buffer, int& size);
+
+	void put(int piece, boost::shared_array<char> buffer, int size);
+
+	size_t capacity;
+
+	size_t used;
+
+	unsigned long long hits;
+
+	unsigned long long misses;
+
+private:
+	struct Entry {
+		int piece;
+
+		boost::shared_array<char> buffer;
+
+		int size;
+	};
+
+	void evict();
+
+	// Most recently used piece first
+	std::list<Entry> entries;
+
+	std::map<int,std::list<Entry>::iterator> index;
+};
+
+class Descriptors
+{
+public:
+	Descriptors(size_t n) : capacity(n) {
+	}
+
+	// Open file, or reuse its descriptor, and keep it open until put()
+	int get(int index);
+
+	void put(int index);
+
+	void clear();
+
+	// Descriptors kept open when no one is using them
+	size_t capacity;
+
+private:
+	struct Entry {
+		int index;
+
+		int fd;
+
+		int refs;
+	};
+
+	void evict();
+
+	// Most recently used file first
+	std::list<Entry> entries;
+
+	std::map<int,std::list<Entry>::iterator> lookup;
+};
+
+class Bitfield
+{
+public:
+	Bitfield() : count(0) {
+	}
+
+	void resize(int n) {
+		bits.assign((n + 63) / 64, 0);
+		count = n;
+	}
+
+	void set(int i) {
+		bits[i / 64] |= 1ULL << (i % 64);
+	}
+
+	void unset(int i) {
+		bits[i / 64] &= ~(1ULL << (i % 64));
+	}
+
+	bool get(int i) const {
+		return i >= 0 && i < count && ((bits[i / 64] >> (i % 64)) & 1);
+	}
+
+	int size() const {
+		return count;
+	}
+
+	bool any() const {
+		for (size_t i = 0; i < bits.size(); ++i) {
+			if (bits[i])
+				return true;
+		}
+
+		return false;
+	}
+
+	int next_unset(int i) const;
+
+private:
+	std::vector<unsigned long long> bits;
+
+	int count;
+};
+
+// Hashing of data found in a cache dir, split between threads
+struct Check
+{
+	const libtorrent::torrent_info *ti;
+
+	// Full paths, by file index. Opened as needed, there may be more
+	// files than descriptors.
+	std::vector<std::string> paths;
+
+	// Pieces to hash, and then pieces that hashed correctly
+	std::vector<char> have;
+
+	// Next piece for a thread to take, and how many it takes at once
+	int next;
+	int span;
 };
 
 class Array
@@ -96,6 +378,16 @@ struct btfs_params {
 	int help;
 	int browse_only;
 	int keep;
+	int cache_size;
+	int deadlines;
+	int prefetch;
+	int buffer_seconds;
+	int eager_size;
+	int readdir_prefetch;
+	int checkpoint;
+	int lazy_verify;
+	int check_threads;
+	const char *cache_dir;
 	const char *metadata;
 };
 
@@ -0,0 +1,615 @@
+/*
+Copyright 2015 Johan Gunnarsson <johan.gunnarsson@gmail.com>
+
+This file is part of BTFS.
+
+BTFS is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+BTFS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <strings.h>
+
+#include "media.h"
+
+// Largest index to read and parse, in bytes
+#define MAX_INDEX (16 << 20)
+
+// Deepest MP4 box nesting to follow, moov/trak/mdia/minf/stbl is 5
+#define MAX_DEPTH 8
+
+using namespace btfs;
+
+typedef unsigned char uchar;
+
+static unsigned long long
+be(const uchar *p, int n) {
+	unsigned long long v = 0;
+
+	for (int i = 0; i < n; i++)
+		v = (v << 8) | p[i];
+
+	return v;
+}
+
+static unsigned long long
+le(const uchar *p, int n) {
+	unsigned long long v = 0;
+
+	for (int i = n - 1; i >= 0; i--)
+		v = (v << 8) | p[i];
+
+	return v;
+}
+
+bool
+btfs::is_media(const std::string& path) {
+	// Same as btplay
+	const char *exts[] = { ".mp4", ".mkv", ".avi" };
+
+	for (size_t i = 0; i < sizeof (exts) / sizeof (exts[0]); i++) {
+		size_t n = strlen(exts[i]);
+
+		if (path.length() >= n && strcasecmp(
+				path.c_str() + path.length() - n, exts[i]) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+void Index::probe(Source& source, libtorrent::size_type size) {
+	char magic[12];
+
+	ranges.clear();
+	seeks.clear();
+
+	duration = 0;
+
+	if (size < (libtorrent::size_type) sizeof (magic)) {
+		complete = true;
+		return;
+	}
+
+	if (!fetch(source, 0, magic, sizeof (magic)))
+		return;
+
+	if (memcmp(magic + 4, "ftyp", 4) == 0)
+		mp4(source, size);
+	else if (be((uchar *) magic, 4) == 0x1A45DFA3)
+		mkv(source, size);
+	else if (memcmp(magic, "RIFF", 4) == 0 &&
+			memcmp(magic + 8, "AVI ", 4) == 0)
+		avi(source, size);
+	else
+		complete = true;
+
+	std::sort(seeks.begin(), seeks.end());
+
+	seeks.erase(std::unique(seeks.begin(), seeks.end()), seeks.end());
+}
+
+bool Index::fetch(Source& source, libtorrent::size_type offset, char *buf,
+		int len) {
+	if (source.read(offset, buf, len))
+		return true;
+
+	missing = range(offset, offset + len);
+
+	return false;
+}
+
+/*
+ * MP4: Walk the top level boxes to find moov, which is often at the end of
+ * the file. Chunk offsets (stco/co64) of the video track are the seek
+ * points.
+ */
+
+struct mp4_track {
+	mp4_track() : video(false) {
+	}
+
+	bool video;
+
+	std::vector<libtorrent::size_type> chunks;
+};
+
+static void
+mp4_boxes(const uchar *p, size_t n, mp4_track *track,
+		std::vector<mp4_track>& tracks, double& duration, int depth) {
+	// Nested boxes come from the torrent, so don't trust them
+	if (depth > MAX_DEPTH)
+		return;
+
+	while (n >= 8) {
+		unsigned long long len = be(p, 4);
+		size_t hl = 8;
+
+		if (len == 1) {
+			if (n < 16)
+				return;
+
+			len = be(p + 8, 8);
+			hl = 16;
+		} else if (len == 0) {
+			len = n;
+		}
+
+		if (len < hl || len > n)
+			return;
+
+		const uchar *b = p + hl;
+		size_t bl = len - hl;
+
+		if (memcmp(p + 4, "trak", 4) == 0) {
+			mp4_track t;
+
+			mp4_boxes(b, bl, &t, tracks, duration, depth + 1);
+
+			tracks.push_back(t);
+		} else if (memcmp(p + 4, "moov", 4) == 0 ||
+				memcmp(p + 4, "mdia", 4) == 0 ||
+				memcmp(p + 4, "minf", 4) == 0 ||
+				memcmp(p + 4, "stbl", 4) == 0) {
+			mp4_boxes(b, bl, track, tracks, duration, depth + 1);
+		} else if (memcmp(p + 4, "mvhd", 4) == 0 && bl >= 4) {
+			// Version 1 has 64 bit times and duration
+			int w = b[0] == 1 ? 8 : 4;
+
+			if (bl >= (size_t) 4 + 3 * w + 4) {
+				unsigned long long scale = be(b + 4 + 2 * w, 4);
+				unsigned long long d = be(b + 8 + 2 * w, w);
+
+				if (scale > 0)
+					duration = (double) d / scale;
+			}
+		} else if (track && memcmp(p + 4, "hdlr", 4) == 0 && bl >= 12) {
+			track->video = memcmp(b + 8, "vide", 4) == 0;
+		} else if (track && (memcmp(p + 4, "stco", 4) == 0 ||
+				memcmp(p + 4, "co64", 4) == 0) && bl >= 8) {
+			int w = p[7] == '4' ? 8 : 4;
+
+			unsigned long long count = std::min(be(b + 4, 4),
+				(unsigned long long) (bl - 8) / w);
+
+			for (unsigned long long i = 0; i < count; i++)
+				track->chunks.push_back(be(b + 8 + i * w, w));
+		}
+
+		p += len;
+		n -= len;
+	}
+}
+
+void Index::mp4(Source& source, libtorrent::size_type size) {
+	libtorrent::size_type offset = 0;
+
+	while (offset + 8 <= size) {
+		uchar h[16];
+
+		int hl = std::min((libtorrent::size_type) sizeof (h),
+			size - offset);
+
+		if (!fetch(source, offset, (char *) h, hl))
+			return;
+
+		libtorrent::size_type len = be(h, 4);
+
+		if (len == 1 && hl >= 16)
+			len = be(h + 8, 8);
+		else if (len == 0)
+			len = size - offset;
+
+		if (len < 8)
+			break;
+
+		if (memcmp(h + 4, "moov", 4) == 0) {
+			ranges.push_back(range(offset, offset + len));
+
+			if (len > MAX_INDEX)
+				break;
+
+			std::vector<char> moov(len);
+
+			if (!fetch(source, offset, &moov[0], len))
+				return;
+
+			std::vector<mp4_track> tracks;
+
+			mp4_boxes((uchar *) &moov[0], len, NULL, tracks,
+				duration, 0);
+
+			bool video = false;
+
+			for (size_t i = 0; i < tracks.size(); i++)
+				video = video || tracks[i].video;
+
+			// Video track chunks, or any chunks if there's no video
+			for (size_t i = 0; i < tracks.size(); i++) {
+				if (tracks[i].video || !video)
+					seeks.insert(seeks.end(),
+						tracks[i].chunks.begin(),
+						tracks[i].chunks.end());
+			}
+
+			break;
+		}
+
+		offset += len;
+	}
+
+	complete = true;
+}
+
+/*
+ * Matroska: Find the Cues element through the SeekHead at the start of the
+ * segment. Cluster positions of the cue points are the seek points.
+ */
+
+#define MKV_SEGMENT 0x18538067
+#define MKV_INFO 0x1549A966
+#define MKV_TIMECODESCALE 0x2AD7B1
+#define MKV_DURATION 0x4489
+#define MKV_SEEKHEAD 0x114D9B74
+#define MKV_SEEK 0x4DBB
+#define MKV_SEEKID 0x53AB
+#define MKV_SEEKPOSITION 0x53AC
+#define MKV_CLUSTER 0x1F43B675
+#define MKV_CUES 0x1C53BB6B
+#define MKV_CUEPOINT 0xBB
+#define MKV_CUETRACKPOSITIONS 0xB7
+#define MKV_CUECLUSTERPOSITION 0xF1
+
+// Parse an EBML variable size integer. Returns its length, or 0.
+static int
+ebml_vint(const uchar *p, size_t n, unsigned long long& v, bool id) {
+	if (n < 1)
+		return 0;
+
+	int len = 1;
+	uchar mask = 0x80;
+
+	while (len <= 8 && !(p[0] & mask)) {
+		mask >>= 1;
+		len++;
+	}
+
+	if (len > 8 || (size_t) len > n)
+		return 0;
+
+	// Element IDs keep their length marker
+	v = id ? p[0] : p[0] & (mask - 1);
+
+	for (int i = 1; i < len; i++)
+		v = (v << 8) | p[i];
+
+	return len;
+}
+
+// Parse an element header. Returns its length, or 0.
+static int
+ebml_header(const uchar *p, size_t n, unsigned long long& id,
+		unsigned long long& len) {
+	int a = ebml_vint(p, n, id, true);
+
+	if (a <= 0)
+		return 0;
+
+	int b = ebml_vint(p + a, n - a, len, false);
+
+	if (b <= 0)
+		return 0;
+
+	// Size with all bits set means unknown size
+	if (len == (1ULL << (7 * b)) - 1)
+		len = ~0ULL;
+
+	return a + b;
+}
+
+// Look for element ID among the children of an element
+static const uchar *
+ebml_find(const uchar *p, size_t n, unsigned long long id, size_t& len) {
+	while (n > 0) {
+		unsigned long long i, l;
+
+		int hl = ebml_header(p, n, i, l);
+
+		if (hl <= 0 || l > n - hl)
+			return NULL;
+
+		if (i == id) {
+			len = l;
+			return p + hl;
+		}
+
+		p += hl + l;
+		n -= hl + l;
+	}
+
+	return NULL;
+}
+
+// Big endian IEEE float or double
+static double
+ebml_float(const uchar *p, size_t n) {
+	if (n == 4) {
+		unsigned int i = be(p, 4);
+		float f;
+
+		memcpy(&f, &i, sizeof (f));
+
+		return f;
+	} else if (n == 8) {
+		unsigned long long i = be(p, 8);
+		double d;
+
+		memcpy(&d, &i, sizeof (d));
+
+		return d;
+	}
+
+	return 0;
+}
+
+static void
+mkv_cues(const uchar *p, size_t n, libtorrent::size_type segment,
+		std::vector<libtorrent::size_type>& seeks) {
+	while (n > 0) {
+		unsigned long long id, len;
+
+		int hl = ebml_header(p, n, id, len);
+
+		if (hl <= 0 || len > n - hl)
+			return;
+
+		size_t pl;
+
+		const uchar *positions = id == MKV_CUEPOINT ?
+			ebml_find(p + hl, len, MKV_CUETRACKPOSITIONS, pl) : NULL;
+
+		size_t cl;
+
+		const uchar *cluster = positions ?
+			ebml_find(positions, pl, MKV_CUECLUSTERPOSITION, cl) :
+			NULL;
+
+		if (cluster && cl <= 8)
+			seeks.push_back(segment + be(cluster, cl));
+
+		p += hl + len;
+		n -= hl + len;
+	}
+}
+
+void Index::mkv(Source& source, libtorrent::size_type size) {
+	uchar h[12];
+	unsigned long long id, len;
+
+	int hl;
+
+	// EBML header
+	if (!fetch(source, 0, (char *) h, sizeof (h)))
+		return;
+
+	if ((hl = ebml_header(h, sizeof (h), id, len)) <= 0 || len == ~0ULL) {
+		complete = true;
+		return;
+	}
+
+	libtorrent::size_type offset = hl + len;
+
+	// Segment, holding everything else
+	if (offset + (libtorrent::size_type) sizeof (h) > size) {
+		complete = true;
+		return;
+	}
+
+	if (!fetch(source, offset, (char *) h, sizeof (h)))
+		return;
+
+	if ((hl = ebml_header(h, sizeof (h), id, len)) <= 0 ||
+			id != MKV_SEGMENT) {
+		complete = true;
+		return;
+	}
+
+	libtorrent::size_type segment = offset + hl;
+	libtorrent::size_type cues = -1, info = -1;
+
+	// Top level elements until the first cluster
+	for (offset = segment; offset + (libtorrent::size_type)
+			sizeof (h) <= size && (cues < 0 || info < 0);) {
+		if (!fetch(source, offset, (char *) h, sizeof (h)))
+			return;
+
+		if ((hl = ebml_header(h, sizeof (h), id, len)) <= 0 ||
+				len == ~0ULL || id == MKV_CLUSTER)
+			break;
+
+		if (id == MKV_INFO) {
+			info = offset;
+		} else if (id == MKV_CUES) {
+			cues = offset;
+		} else if (id == MKV_SEEKHEAD && len > 0) {
+			if (len > MAX_INDEX)
+				break;
+
+			std::vector<char> buf(len);
+
+			if (!fetch(source, offset + hl, &buf[0], len))
+				return;
+
+			const uchar *p = (uchar *) &buf[0];
+			size_t n = len;
+
+			while (n > 0) {
+				unsigned long long i, l;
+
+				int sl = ebml_header(p, n, i, l);
+
+				if (sl <= 0 || l > n - sl)
+					break;
+
+				size_t il, pl;
+
+				const uchar *sid = i != MKV_SEEK ? NULL :
+					ebml_find(p + sl, l, MKV_SEEKID, il);
+				const uchar *pos = i != MKV_SEEK ? NULL :
+					ebml_find(p + sl, l, MKV_SEEKPOSITION, pl);
+
+				if (sid && pos && il <= 4 && pl <= 8 &&
+						be(sid, il) == MKV_CUES)
+					cues = segment + be(pos, pl);
+
+				if (sid && pos && il <= 4 && pl <= 8 &&
+						be(sid, il) == MKV_INFO)
+					info = segment + be(pos, pl);
+
+				p += sl + l;
+				n -= sl + l;
+			}
+		}
+
+		offset += hl + len;
+	}
+
+	if (info >= 0 && info + (libtorrent::size_type) sizeof (h) <= size) {
+		if (!fetch(source, info, (char *) h, sizeof (h)))
+			return;
+
+		hl = ebml_header(h, sizeof (h), id, len);
+
+		if (hl > 0 && id == MKV_INFO && len <= MAX_INDEX) {
+			std::vector<char> buf(len + 1);
+
+			if (!fetch(source, info + hl, &buf[0], len))
+				return;
+
+			size_t sl, dl;
+
+			const uchar *scale = ebml_find((uchar *) &buf[0], len,
+				MKV_TIMECODESCALE, sl);
+			const uchar *d = ebml_find((uchar *) &buf[0], len,
+				MKV_DURATION, dl);
+
+			// Duration is in units of the timecode scale, which
+			// is in nanoseconds
+			double ns = scale && sl <= 8 ? be(scale, sl) : 1000000;
+
+			if (d)
+				duration = ebml_float(d, dl) * ns / 1000000000;
+		}
+	}
+
+	if (cues < 0 || cues + (libtorrent::size_type) sizeof (h) > size) {
+		complete = true;
+		return;
+	}
+
+	if (!fetch(source, cues, (char *) h, sizeof (h)))
+		return;
+
+	if ((hl = ebml_header(h, sizeof (h), id, len)) <= 0 || id != MKV_CUES ||
+			len == ~0ULL) {
+		complete = true;
+		return;
+	}
+
+	ranges.push_back(range(cues, cues + hl + len));
+
+	// Nothing to parse, or too much
+	if (len == 0 || len > MAX_INDEX) {
+		complete = true;
+		return;
+	}
+
+	std::vector<char> buf(len);
+
+	if (!fetch(source, cues + hl, &buf[0], len))
+		return;
+
+	mkv_cues((uchar *) &buf[0], len, segment, seeks);
+
+	complete = true;
+}
+
+/*
+ * AVI: The idx1 chunk follows the movi list at the end of the file.
+ * Keyframe entries are the seek points.
+ */
+
+#define AVIIF_KEYFRAME 0x10
+
+void Index::avi(Source& source, libtorrent::size_type size) {
+	libtorrent::size_type offset = 12, movi = -1;
+
+	while (offset + 12 <= size) {
+		uchar h[12];
+
+		if (!fetch(source, offset, (char *) h, sizeof (h)))
+			return;
+
+		libtorrent::size_type len = le(h + 4, 4);
+
+		if (memcmp(h, "LIST", 4) == 0 && memcmp(h + 8, "movi", 4) == 0)
+			// Index offsets are relative to the movi fourcc
+			movi = offset + 8;
+
+		if (memcmp(h, "LIST", 4) == 0 && memcmp(h + 8, "hdrl", 4) == 0 &&
+				offset + 40 <= size) {
+			uchar a[28];
+
+			if (!fetch(source, offset + 12, (char *) a, sizeof (a)))
+				return;
+
+			// Main header, with microseconds per frame and frame
+			// count
+			if (memcmp(a, "avih", 4) == 0)
+				duration = le(a + 8, 4) * le(a + 24, 4) / 1000000.0;
+		}
+
+		if (memcmp(h, "idx1", 4) == 0) {
+			ranges.push_back(range(offset, offset + 8 + len));
+
+			if (len == 0 || len > MAX_INDEX)
+				break;
+
+			std::vector<char> buf(len);
+
+			if (!fetch(source, offset + 8, &buf[0], len))
+				return;
+
+			const uchar *p = (uchar *) &buf[0];
+
+			// Some muxers write absolute offsets. Then the first
+			// entry points past the movi fourcc.
+			bool absolute = movi < 0 ||
+				(len >= 16 && (libtorrent::size_type) le(p + 8, 4) > movi);
+
+			for (libtorrent::size_type i = 0; i + 16 <= len; i += 16) {
+				libtorrent::size_type o = le(p + i + 8, 4);
+
+				if (le(p + i + 4, 4) & AVIIF_KEYFRAME)
+					seeks.push_back(absolute ? o : movi + o);
+			}
+
+			break;
+		}
+
+		offset += 8 + len + (len & 1);
+	}
+
+	complete = true;
+}
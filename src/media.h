@@ -0,0 +1,85 @@
+/*
+Copyright 2015 Johan Gunnarsson <johan.gunnarsson@gmail.com>
+
+This file is part of BTFS.
+
+BTFS is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+BTFS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BTFS_MEDIA_H
+#define BTFS_MEDIA_H
+
+#include <string>
+#include <vector>
+
+#include <libtorrent/size_type.hpp>
+
+namespace btfs
+{
+
+typedef std::pair<libtorrent::size_type,libtorrent::size_type> range;
+
+class Source
+{
+public:
+	virtual ~Source() {
+	}
+
+	// Fill buf with len bytes at offset, or return false if they aren't
+	// available (yet)
+	virtual bool read(libtorrent::size_type offset, char *buf,
+		int len) = 0;
+};
+
+class Index
+{
+public:
+	Index() : duration(0), missing(0, 0), complete(false) {
+	}
+
+	// Parse as far as the available data allows. Call again once the
+	// missing range is available.
+	void probe(Source& source, libtorrent::size_type size);
+
+	// Where the container keeps its index, worth having early
+	std::vector<range> ranges;
+
+	// Offsets where playback can resume after a seek, in order
+	std::vector<libtorrent::size_type> seeks;
+
+	// Playback time in seconds, or 0 if unknown
+	double duration;
+
+	// Data needed to continue parsing
+	range missing;
+
+	// Done parsing, or not a container we know
+	bool complete;
+
+private:
+	bool fetch(Source& source, libtorrent::size_type offset, char *buf,
+		int len);
+
+	void mp4(Source& source, libtorrent::size_type size);
+
+	void mkv(Source& source, libtorrent::size_type size);
+
+	void avi(Source& source, libtorrent::size_type size);
+};
+
+bool is_media(const std::string& path);
+
+}
+
+#endif
@@ -0,0 +1,201 @@
+/*
+Copyright 2015 Johan Gunnarsson <johan.gunnarsson@gmail.com>
+
+This file is part of BTFS.
+
+BTFS is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+BTFS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstring>
+#include <stdint.h>
+
+#include <libtorrent/hasher.hpp>
+
+#include "sha1.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(__GNUC__ >= 5 || defined(__clang__))
+#define SHA_NI 1
+#endif
+
+#ifdef SHA_NI
+#include <cpuid.h>
+#include <immintrin.h>
+
+static bool
+has_sha_ni() {
+	unsigned int a, b, c, d;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return false;
+
+	__cpuid(1, a, b, c, d);
+
+	if (!(c & bit_SSSE3) || !(c & bit_SSE4_1))
+		return false;
+
+	__cpuid_count(7, 0, a, b, c, d);
+
+	// SHA bit of extended features
+	return (b & (1 << 29)) != 0;
+}
+
+static const bool sha_ni = has_sha_ni();
+
+// Compress 64 byte blocks into state, four rounds per instruction
+__attribute__((target("sha,ssse3,sse4.1")))
+static void
+compress(uint32_t state[5], const unsigned char *data, size_t blocks) {
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+		0x08090a0b0c0d0e0fULL);
+
+	__m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(
+		(const __m128i *) state), 0x1b);
+	__m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+	__m128i e1, m0, m1, m2, m3;
+
+	for (; blocks > 0; blocks--, data += 64) {
+		__m128i abcd0 = abcd;
+		__m128i e00 = e0;
+
+		// Rounds 0-3
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128(
+			(const __m128i *) data), mask);
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		// Rounds 4-7
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128(
+			(const __m128i *) (data + 16)), mask);
+		e1 = _mm_sha1nexte_epu32(e1, m1);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+		m0 = _mm_sha1msg1_epu32(m0, m1);
+
+		// Rounds 8-11
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128(
+			(const __m128i *) (data + 32)), mask);
+		e0 = _mm_sha1nexte_epu32(e0, m2);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		m1 = _mm_sha1msg1_epu32(m1, m2);
+		m0 = _mm_xor_si128(m0, m2);
+
+		// Rounds 12-15
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128(
+			(const __m128i *) (data + 48)), mask);
+		e1 = _mm_sha1nexte_epu32(e1, m3);
+		e0 = abcd;
+		m0 = _mm_sha1msg2_epu32(m0, m3);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+		m2 = _mm_sha1msg1_epu32(m2, m3);
+		m1 = _mm_xor_si128(m1, m3);
+
+// Four rounds with message schedule, for rounds 16-67
+#define ROUNDS(f, ea, eb, ma, mb, mc, md) \
+		ea = _mm_sha1nexte_epu32(ea, ma); \
+		eb = abcd; \
+		mb = _mm_sha1msg2_epu32(mb, ma); \
+		abcd = _mm_sha1rnds4_epu32(abcd, ea, f); \
+		md = _mm_sha1msg1_epu32(md, ma); \
+		mc = _mm_xor_si128(mc, ma);
+
+		ROUNDS(0, e0, e1, m0, m1, m2, m3)	// 16-19
+		ROUNDS(1, e1, e0, m1, m2, m3, m0)	// 20-23
+		ROUNDS(1, e0, e1, m2, m3, m0, m1)	// 24-27
+		ROUNDS(1, e1, e0, m3, m0, m1, m2)	// 28-31
+		ROUNDS(1, e0, e1, m0, m1, m2, m3)	// 32-35
+		ROUNDS(1, e1, e0, m1, m2, m3, m0)	// 36-39
+		ROUNDS(2, e0, e1, m2, m3, m0, m1)	// 40-43
+		ROUNDS(2, e1, e0, m3, m0, m1, m2)	// 44-47
+		ROUNDS(2, e0, e1, m0, m1, m2, m3)	// 48-51
+		ROUNDS(2, e1, e0, m1, m2, m3, m0)	// 52-55
+		ROUNDS(2, e0, e1, m2, m3, m0, m1)	// 56-59
+		ROUNDS(3, e1, e0, m3, m0, m1, m2)	// 60-63
+		ROUNDS(3, e0, e1, m0, m1, m2, m3)	// 64-67
+
+#undef ROUNDS
+
+		// Rounds 68-71
+		e1 = _mm_sha1nexte_epu32(e1, m1);
+		e0 = abcd;
+		m2 = _mm_sha1msg2_epu32(m2, m1);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+		m3 = _mm_xor_si128(m3, m1);
+
+		// Rounds 72-75
+		e0 = _mm_sha1nexte_epu32(e0, m2);
+		e1 = abcd;
+		m3 = _mm_sha1msg2_epu32(m3, m2);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+		// Rounds 76-79
+		e1 = _mm_sha1nexte_epu32(e1, m3);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+		e0 = _mm_sha1nexte_epu32(e0, e00);
+		abcd = _mm_add_epi32(abcd, abcd0);
+	}
+
+	_mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1b));
+
+	state[4] = _mm_extract_epi32(e0, 3);
+}
+
+static std::string
+sha1_ni(const unsigned char *buf, int len) {
+	uint32_t state[5] = {
+		0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+	};
+
+	compress(state, buf, len / 64);
+
+	// Remaining bytes, padding and length in bits, in one or two blocks
+	unsigned char tail[128];
+
+	int n = len % 64;
+	int blocks = n < 56 ? 1 : 2;
+
+	memset(tail, 0, sizeof (tail));
+	memcpy(tail, buf + len - n, n);
+
+	tail[n] = 0x80;
+
+	unsigned long long bits = (unsigned long long) len * 8;
+
+	for (int i = 0; i < 8; i++)
+		tail[blocks * 64 - 1 - i] = bits >> (i * 8);
+
+	compress(state, tail, blocks);
+
+	char digest[20];
+
+	for (int i = 0; i < 20; i++)
+		digest[i] = state[i / 4] >> (24 - (i % 4) * 8);
+
+	return std::string(digest, sizeof (digest));
+}
+#endif
+
+std::string
+btfs::sha1(const char *buf, int len) {
+#ifdef SHA_NI
+	if (sha_ni)
+		return sha1_ni((const unsigned char *) buf, len);
+#endif
+
+	return libtorrent::hasher(buf, len).final().to_string();
+}
@@ -0,0 +1,34 @@
+/*
+Copyright 2015 Johan Gunnarsson <johan.gunnarsson@gmail.com>
+
+This file is part of BTFS.
+
+BTFS is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+BTFS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BTFS_SHA1_H
+#define BTFS_SHA1_H
+
+#include <string>
+
+namespace btfs
+{
+
+// SHA-1 digest of len bytes at buf, as 20 raw bytes. Uses the CPU's SHA
+// extensions when it has them.
+std::string sha1(const char *buf, int len);
+
+}
+
+#endif